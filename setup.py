@@ -65,6 +65,7 @@ Flags:
       license = "MIT",
       keywords = "QDBM",
       url = "https://www.hirano.cc/pyqdbm",
+      python_requires = ">=3.10",
       packages = ["qdbm"],
       ext_package = "qdbm",
       ext_modules = [Extension( name = "depot",
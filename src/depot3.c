@@ -1,76 +1,872 @@
 /* Depot module using dictionary interface */
 /* Author: Yoshitaka Hirano */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include "depot.h"
 
+#define DEPOT_HEADSIZ   48          /* size of the depot file header */
+#define DEPOT_WARMBUFSIZ (1 << 20)  /* read size used by warm() */
+#define DEPOT_COPYBUFSIZ (1 << 20)  /* read/write size used by snapshot() */
+
+#define DEPOTLOG_MAGIC    "QDBMDL2\n" /* first bytes of a change log */
+#define DEPOTLOG_MAGICSIZ 8
+#define DEPOTLOG_FILEHEADSIZ 16       /* magic(8) id(8) */
+#define DEPOTLOG_HEADSIZ  17          /* seq(8) op(1) ksiz(4) vsiz(4) */
+#define DEPOTLOG_PUT      'P'
+#define DEPOTLOG_OUT      'D'
+
 typedef struct {
     char *dptr;
     int   dsize;
 } datum;
 
+/* Writer side of a change log */
+typedef struct {
+    int fd;
+    unsigned long long id;    /* identity of this log file */
+    unsigned long long seq;   /* last sequence number appended */
+    int batch;                /* records buffered before write(2) */
+    int sync;                 /* fsync(2) after every write(2) */
+    int count;                /* records currently buffered */
+    char *buf;
+    size_t size, used;
+} depotlog;
+
+/* Reader side of a change log */
+typedef struct {
+    FILE *fp;
+    off_t fsiz;               /* file size when the reader was opened */
+    off_t end;                /* offset just past the last complete record */
+    unsigned long long id;    /* identity from the header, 0 if none */
+    unsigned long long expect; /* seq the next record must reach, 0 if any */
+    unsigned long long last;  /* seq of the last record read */
+    PyObject *error;          /* exception type for errors */
+    unsigned long long seq;
+    int op;
+    char *kbuf, *vbuf;
+    unsigned int ksiz, vsiz;
+    char *buf;
+    size_t bufsiz;
+} depotlogreader;
+
+/* Where to resume reading a change log: the next sequence number, the
+   byte offset of its record and the identity of the log, or id 0 to
+   search from the start */
+typedef struct {
+    unsigned long long seq;
+    off_t offset;
+    unsigned long long id;
+} depotlogpos;
+
+/* A DEPOT handle is not thread safe.  Every QDBM call on it is made with
+   `lock' held, and never while calling back into Python.  Updates also
+   hold `wlock' around their `lock' section, so that snapshot() can keep
+   updates out while readers carry on.  A handle used in a forked child
+   is reopened (readers) or detached (writers) first; see
+   _depot_afterfork(). */
 typedef struct {
     PyObject_HEAD
     DEPOT *depot;
+    depotlog *log;            /* NULL unless opened with a change log */
+    PyThread_type_lock lock;  /* held around every call into QDBM */
+    PyThread_type_lock wlock; /* held by updates and by snapshot() */
+    PyThread_type_lock idle;  /* held while busy > 0 */
+    int busy;                 /* warm() calls reading the file without `lock' */
+    pid_t pid;                /* process that opened `depot' */
+    int orphaned;             /* writer inherited across fork */
+    int forkerr;              /* QDBM error from reopening after fork */
+    unsigned long itergen;    /* bumped whenever the record iterator restarts */
+    char *name;               /* dpopen() arguments, for reopening */
+    int omode;
+    int bnum;
+    int advice;
 } DepotObject;
 
-static PyTypeObject DepotType;
+typedef struct {
+    PyObject_HEAD
+    PyObject *handles;        /* tuple of reader DepotObjects */
+    PyObject *assigned;       /* thread ident -> index into handles */
+    Py_ssize_t next;          /* next index to hand out */
+} ReaderPoolObject;
+
+struct module_state {
+    PyObject *error;
+    PyObject *logerror;       /* subclass of error: update stored, not logged */
+    PyTypeObject *depot_type;
+    PyTypeObject *keyiter_type;
+    PyTypeObject *itemiter_type;
+    PyTypeObject *valueiter_type;
+    PyTypeObject *readerpool_type;
+    PyTypeObject *logiter_type;
+};
+
+#define get_module_state(m) ((struct module_state *)PyModule_GetState(m))
+#define get_depot_state(v) \
+               ((struct module_state *)PyType_GetModuleState(Py_TYPE(v)))
+#define DepotError(v) (get_depot_state(v)->error)
+#define DEPOT_CLOSED_MSG "DEPOT object has already been closed"
+#define DEPOT_ITERRESET_MSG \
+    "DEPOT iterator was restarted by another iteration over the same object"
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/* Current process id, refreshed in forked children */
+static pid_t depot_pid;
+static pthread_once_t depot_once = PTHREAD_ONCE_INIT;
+
+/* QDBM keeps dpecode per thread only when it was built with pthread
+   support.  Otherwise the error code is one process-wide variable, and
+   every QDBM call in the process is made under depot_serial so that the
+   code is read before another call (on any handle, in any interpreter)
+   can overwrite it. */
+static int depot_reentrant;
+static pthread_mutex_t depot_serial = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held while a handle is reopened after fork; see _depot_afterfork() */
+static pthread_mutex_t depot_fork = PTHREAD_MUTEX_INITIALIZER;
+
+static void depot_atfork_child(void)
+{
+    depot_pid = getpid();
+    /* A parent thread may have held them */
+    pthread_mutex_init(&depot_serial, NULL);
+    pthread_mutex_init(&depot_fork, NULL);
+}
+
+/* Enter and leave depot_serial; for use without the GIL */
+static void depot_serial_lock(void)
+{
+    if (!depot_reentrant) {
+        pthread_mutex_lock(&depot_serial);
+    }
+}
+
+static void depot_serial_unlock(void)
+{
+    if (!depot_reentrant) {
+        pthread_mutex_unlock(&depot_serial);
+    }
+}
+
+static void *depot_ecodeptr(void *arg)
+{
+    *(int **)arg = dpecodeptr();
+    return NULL;
+}
+
+static void depot_init(void)
+{
+    pthread_t th;
+    int *other = NULL;
+
+    depot_pid = getpid();
+    pthread_atfork(NULL, NULL, depot_atfork_child);
+    if (pthread_create(&th, NULL, depot_ecodeptr, &other) == 0) {
+        pthread_join(th, NULL);
+        depot_reentrant = other != NULL && other != dpecodeptr();
+    }
+}
+
+// ---- Change log
+static void depotlog_put32(char *p, unsigned int v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static unsigned int depotlog_get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((unsigned int)u[0] << 24) | ((unsigned int)u[1] << 16) |
+           ((unsigned int)u[2] << 8) | (unsigned int)u[3];
+}
 
-#define is_depotobject(v) ((v)->ob_type == &DepotType)
-#define check_depotobject_open(v) if ((v)->depot == NULL) \
-               { PyErr_SetString(DepotError, "DEPOT object has already been closed"); \
-                 return NULL; }
+static void depotlog_put64(char *p, unsigned long long v)
+{
+    depotlog_put32(p, (unsigned int)(v >> 32));
+    depotlog_put32(p + 4, (unsigned int)v);
+}
 
-static PyObject *DepotError;
+static unsigned long long depotlog_get64(const char *p)
+{
+    return ((unsigned long long)depotlog_get32(p) << 32) | depotlog_get32(p + 4);
+}
+
+/* A fresh identity for a new log file, so that positions taken on an
+   earlier file of the same name are recognized as foreign.  Never 0. */
+static unsigned long long depotlog_newid(void)
+{
+    unsigned long long id = 0;
+    struct timespec ts;
+    int fd;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) != -1) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id)) {
+            id = 0;
+        }
+        close(fd);
+    }
+    if (id == 0 && clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+        id = ((unsigned long long)ts.tv_sec << 30) ^ (unsigned long long)ts.tv_nsec ^
+             ((unsigned long long)getpid() << 48);
+    }
+    return id ? id : 1;
+}
+
+/* Open a log for reading.  A missing or empty file has no records.
+   Returns -1 with a Python exception set on error. */
+static int depotlog_reader_open(depotlogreader *rd, const char *path,
+                                PyObject *error)
+{
+    char head[DEPOTLOG_FILEHEADSIZ];
+    struct stat sbuf;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->error = error;
+    if (!(rd->fp = fopen(path, "rb"))) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        PyErr_SetFromErrnoWithFilename(error, path);
+        return -1;
+    }
+    if (fstat(fileno(rd->fp), &sbuf) == -1) {
+        PyErr_SetFromErrnoWithFilename(error, path);
+        fclose(rd->fp);
+        rd->fp = NULL;
+        return -1;
+    }
+    rd->fsiz = sbuf.st_size;
+    if (fread(head, 1, DEPOTLOG_FILEHEADSIZ, rd->fp) != DEPOTLOG_FILEHEADSIZ) {
+        return 0;
+    }
+    if (memcmp(head, DEPOTLOG_MAGIC, DEPOTLOG_MAGICSIZ) != 0) {
+        PyErr_Format(error, "%s is not a depot change log", path);
+        fclose(rd->fp);
+        rd->fp = NULL;
+        return -1;
+    }
+    rd->id = depotlog_get64(head + DEPOTLOG_MAGICSIZ);
+    rd->end = DEPOTLOG_FILEHEADSIZ;
+    return 0;
+}
+
+/* Advance to the next complete record.  Payloads of records older than
+   `from' are skipped, not read.  A truncated record at the tail (e.g. a
+   batch still being written) ends the scan.  After a seek, a log that
+   skips or never reaches the expected sequence number is an error.
+   Returns 1 on a record, 0 at the end, -1 with a Python exception set on
+   error. */
+static int depotlog_reader_next(depotlogreader *rd, unsigned long long from)
+{
+    char head[DEPOTLOG_HEADSIZ];
+    size_t need;
+
+    if (rd->fp == NULL || rd->end + DEPOTLOG_HEADSIZ > rd->fsiz ||
+        fseeko(rd->fp, rd->end, SEEK_SET) == -1 ||
+        fread(head, 1, DEPOTLOG_HEADSIZ, rd->fp) != DEPOTLOG_HEADSIZ) {
+        goto end;
+    }
+    rd->seq = depotlog_get64(head);
+    rd->op = head[8];
+    rd->ksiz = depotlog_get32(head + 9);
+    rd->vsiz = depotlog_get32(head + 13);
+    need = (size_t)rd->ksiz + rd->vsiz;
+    if (rd->end + DEPOTLOG_HEADSIZ + (off_t)need > rd->fsiz) {
+        goto end;
+    }
+    if (rd->expect > 0 && rd->seq >= rd->expect) {
+        if (rd->seq != rd->expect) {
+            PyErr_Format(rd->error, "change log skips from seq %llu to %llu",
+                         rd->expect, rd->seq);
+            return -1;
+        }
+        rd->expect = 0;
+    }
+    if (rd->seq >= from) {
+        if (need + 1 > rd->bufsiz) {
+            char *tmp = realloc(rd->buf, need + 1);
+            if (tmp == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            rd->buf = tmp;
+            rd->bufsiz = need + 1;
+        }
+        if (fread(rd->buf, 1, need, rd->fp) != need) {
+            return 0;
+        }
+        rd->kbuf = rd->buf;
+        rd->vbuf = rd->buf + rd->ksiz;
+    }
+    rd->end += DEPOTLOG_HEADSIZ + need;
+    rd->last = rd->seq;
+    return 1;
+
+  end:
+    /* Records up to expect - 1 were seen when the position was taken, so
+       they cannot be missing unless the log was replaced */
+    if (rd->expect > 1 && rd->last + 1 < rd->expect) {
+        PyErr_Format(rd->error, "change log ends at seq %llu, before seq %llu",
+                     rd->last, rd->expect);
+        return -1;
+    }
+    return 0;
+}
+
+/* Continue from a position returned earlier.  A position with an id
+   must come from this very log file and name the record at its offset;
+   one without (a bare sequence number) searches from the first record.
+   Either way the records must then continue from pos->seq without a gap.
+   Returns -1 with a Python exception set if the position does not fit
+   the log. */
+static int depotlog_reader_seek(depotlogreader *rd, const depotlogpos *pos)
+{
+    char head[8];
+
+    rd->expect = pos->seq;
+    if (pos->id == 0) {
+        return 0;
+    }
+    if (rd->id != pos->id) {
+        PyErr_SetString(rd->error, "change log was replaced since the position "
+                        "was taken");
+        return -1;
+    }
+    if (pos->offset < DEPOTLOG_FILEHEADSIZ || pos->offset > rd->fsiz) {
+        PyErr_SetString(rd->error, "position is outside the change log");
+        return -1;
+    }
+    if (pos->offset + DEPOTLOG_HEADSIZ <= rd->fsiz) {
+        if (fseeko(rd->fp, pos->offset, SEEK_SET) == -1 ||
+            fread(head, 1, sizeof(head), rd->fp) != sizeof(head)) {
+            PyErr_SetFromErrno(rd->error);
+            return -1;
+        }
+        if (depotlog_get64(head) != pos->seq) {
+            PyErr_Format(rd->error, "change log has no record %llu at offset %lld",
+                         pos->seq, (long long)pos->offset);
+            return -1;
+        }
+    }
+    rd->end = pos->offset;
+    rd->last = pos->seq > 0 ? pos->seq - 1 : 0;
+    return 0;
+}
+
+static void depotlog_reader_close(depotlogreader *rd)
+{
+    if (rd->fp) {
+        fclose(rd->fp);
+        rd->fp = NULL;
+    }
+    free(rd->buf);
+    rd->buf = NULL;
+    rd->bufsiz = 0;
+}
+
+/* "O&" converter for a log position: a sequence number, or the
+   (seq, offset, id) triple returned by apply(), snapshot() and tail() */
+static int depotlog_posconv(PyObject *arg, void *addr)
+{
+    depotlogpos *pos = addr;
+    long long offset = 0;
+
+    pos->id = 0;
+    if (PyTuple_Check(arg)) {
+        if (!PyArg_ParseTuple(arg, "KLK;position should be (seq, offset, id)",
+                              &pos->seq, &offset, &pos->id)) {
+            return 0;
+        }
+    } else {
+        pos->seq = PyLong_AsUnsignedLongLong(arg);
+        if (pos->seq == (unsigned long long)-1 && PyErr_Occurred()) {
+            return 0;
+        }
+    }
+    pos->offset = offset;
+    return 1;
+}
+
+static PyObject *depotlog_posvalue(const depotlogpos *pos)
+{
+    return Py_BuildValue("(KLK)", pos->seq, (long long)pos->offset, pos->id);
+}
+
+/* Write out buffered records.  Returns -1 with errno set on error. */
+static int depotlog_flush(depotlog *log)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < log->used) {
+        n = write(log->fd, log->buf + off, log->used - off);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Keep only what was not written, so a retry does not
+               duplicate records */
+            memmove(log->buf, log->buf + off, log->used - off);
+            log->used -= off;
+            return -1;
+        }
+        off += n;
+    }
+    log->used = 0;
+    log->count = 0;
+    if (off > 0 && log->sync && fsync(log->fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Buffer a record.  Returns 1 when a full batch is waiting to be
+   flushed, 0 otherwise, -1 with errno set on error. */
+static int depotlog_append(depotlog *log, int op, const char *kbuf, int ksiz,
+                           const char *vbuf, int vsiz)
+{
+    size_t need = DEPOTLOG_HEADSIZ + (size_t)ksiz + vsiz;
+    char *p;
+
+    if (log->used + need > log->size) {
+        size_t size = log->size ? log->size : 4096;
+        while (size < log->used + need) {
+            size *= 2;
+        }
+        if (!(p = realloc(log->buf, size))) {
+            errno = ENOMEM;
+            return -1;
+        }
+        log->buf = p;
+        log->size = size;
+    }
+    p = log->buf + log->used;
+    depotlog_put64(p, log->seq + 1);
+    p[8] = (char)op;
+    depotlog_put32(p + 9, ksiz);
+    depotlog_put32(p + 13, vsiz);
+    memcpy(p + DEPOTLOG_HEADSIZ, kbuf, ksiz);
+    if (vsiz > 0) {
+        memcpy(p + DEPOTLOG_HEADSIZ + ksiz, vbuf, vsiz);
+    }
+    log->used += need;
+    log->seq++;
+    return ++log->count >= log->batch;
+}
+
+/* Drop the record just buffered by depotlog_append(), whose update
+   failed.  `used' is log->used from before the append. */
+static void depotlog_unappend(depotlog *log, size_t used)
+{
+    log->used = used;
+    log->count--;
+    log->seq--;
+}
+
+/* Open a log for appending.  The last sequence number is recovered from
+   the existing records and a torn record at the tail is cut off.  A new
+   log gets a header with a fresh identity. */
+static depotlog *depotlog_open(const char *path, int batch, int sync,
+                               PyObject *error)
+{
+    depotlogreader rd;
+    depotlog *log;
+    char head[DEPOTLOG_FILEHEADSIZ];
+    int rv;
+
+    if (depotlog_reader_open(&rd, path, error) == -1) {
+        return NULL;
+    }
+    if (!(log = calloc(1, sizeof(depotlog)))) {
+        depotlog_reader_close(&rd);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    while ((rv = depotlog_reader_next(&rd, ~0ULL)) == 1) {
+        log->seq = rd.seq;
+    }
+    depotlog_reader_close(&rd);
+    if (rv == -1) {
+        free(log);
+        return NULL;
+    }
+    log->batch = batch > 0 ? batch : 1;
+    log->sync = sync;
+    log->id = rd.end > 0 ? rd.id : depotlog_newid();
+    memcpy(head, DEPOTLOG_MAGIC, DEPOTLOG_MAGICSIZ);
+    depotlog_put64(head + DEPOTLOG_MAGICSIZ, log->id);
+    if ((log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1 ||
+        (rd.end < rd.fsiz && ftruncate(log->fd, rd.end) == -1) ||
+        (rd.end == 0 &&
+         write(log->fd, head, sizeof(head)) != sizeof(head))) {
+        PyErr_SetFromErrnoWithFilename(error, path);
+        if (log->fd != -1) {
+            close(log->fd);
+        }
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+/* Flush and release a log.  Returns -1 with errno set if the final
+   flush failed; the log is released either way. */
+static int depotlog_close(depotlog *log)
+{
+    int rv = depotlog_flush(log);
+    int err = errno;
+
+    close(log->fd);
+    free(log->buf);
+    free(log);
+    errno = err;
+    return rv;
+}
 
 // ---- Constructor
-static PyObject *depot_new(char *file, int flags, int size)
+static PyObject *depot_new(struct module_state *st, char *file, int flags,
+                           int size, int advice)
 {
     DepotObject *dp;
+    int ecode = DP_ENOERR;
 
-    dp = PyObject_New(DepotObject, &DepotType);
+    dp = PyObject_New(DepotObject, st->depot_type);
     if (dp == NULL)
         return NULL;
-    if (!(dp->depot = dpopen(file, flags, size))) {
-        PyErr_SetString(DepotError, dperrmsg(dpecode));
+    dp->log = NULL;
+    dp->depot = NULL;
+    dp->pid = depot_pid;
+    dp->orphaned = 0;
+    dp->forkerr = DP_ENOERR;
+    dp->itergen = 0;
+    dp->name = strdup(file);
+    dp->omode = flags;
+    dp->bnum = size;
+    dp->advice = advice;
+    dp->lock = PyThread_allocate_lock();
+    dp->wlock = PyThread_allocate_lock();
+    dp->idle = PyThread_allocate_lock();
+    dp->busy = 0;
+    if (dp->name == NULL || dp->lock == NULL || dp->wlock == NULL ||
+        dp->idle == NULL) {
+        Py_DECREF(dp);
+        return PyErr_NoMemory();
+    }
+    Py_BEGIN_ALLOW_THREADS
+    depot_serial_lock();
+    if (!(dp->depot = dpopen(file, flags, size)))
+        ecode = dpecode;
+    depot_serial_unlock();
+    Py_END_ALLOW_THREADS
+    if (dp->depot == NULL) {
+        PyErr_SetString(st->error, dperrmsg(ecode));
         Py_DECREF(dp);
         return NULL;
     }
+#ifdef POSIX_FADV_NORMAL
+    /* Access pattern hint is advisory; failure is not an error */
+    if (advice != POSIX_FADV_NORMAL)
+        posix_fadvise(dpfdesc(dp->depot), 0, 0, advice);
+#endif
     return (PyObject *)dp;
 }
 
+/* Add the lock mode to *omode and map the access hint to *advice */
+static int _depot_openopts(struct module_state *st, const char *access,
+                           const char *lock, int *omode, int *advice)
+{
+    if (access != NULL && strcmp(access, "random") != 0 &&
+        strcmp(access, "sequential") != 0) {
+        PyErr_SetString(st->error,
+                        "access should be 'random' or 'sequential'");
+        return -1;
+    }
+    /* The hint itself is only given where posix_fadvise() exists */
+    *advice = 0;
+#ifdef POSIX_FADV_NORMAL
+    *advice = POSIX_FADV_NORMAL;
+    if (access != NULL) {
+        *advice = strcmp(access, "random") == 0 ? POSIX_FADV_RANDOM
+                                                : POSIX_FADV_SEQUENTIAL;
+    }
+#endif
+    if (lock == NULL || strcmp(lock, "shared") == 0) {
+        /* default: shared lock for readers, exclusive for writers */
+    } else if (strcmp(lock, "none") == 0) {
+        *omode |= DP_ONOLCK;
+    } else if (strcmp(lock, "nonblocking") == 0) {
+        *omode |= DP_OLCKNB;
+    } else {
+        PyErr_SetString(st->error,
+                        "lock should be 'shared', 'none' or 'nonblocking'");
+        return -1;
+    }
+    return 0;
+}
+
+// ---- Fork handling
+/* Let go of a handle inherited from the parent process.  The DEPOT is
+   abandoned, not closed: dpclose() of a writer would write to the file
+   the parent still owns, and closing any descriptor for the file would
+   drop the fcntl() locks this process holds on it through handles it
+   has already reopened.  Its descriptor and mapping (shared with the
+   parent) are leaked.  Buffered change log records belong to the parent
+   and are dropped. */
+static void _depot_detach(DepotObject *dp)
+{
+    if (dp->log) {
+        close(dp->log->fd);
+        free(dp->log->buf);
+        free(dp->log);
+        dp->log = NULL;
+    }
+    dp->depot = NULL;
+}
+
+/* First use of a handle in a forked child.  The locks may have been
+   held by parent threads that do not exist here, so they are replaced.
+   Readers get a fresh handle with their own file offset and iterator;
+   writers are left closed.  The reopen runs without the GIL, since it
+   may wait for another process's lock; depot_fork keeps a second
+   thread from handling the same object meanwhile.  A failed reopen is
+   kept in `forkerr' and reported on use. */
+static void _depot_afterfork(DepotObject *dp)
+{
+    PyThread_type_lock lock;
+    int ecode = DP_ENOERR;
+
+    if (pthread_mutex_trylock(&depot_fork) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&depot_fork);
+        Py_END_ALLOW_THREADS
+    }
+    if (dp->pid != depot_pid) {
+        if ((lock = PyThread_allocate_lock()) != NULL) {
+            dp->lock = lock;
+        }
+        if ((lock = PyThread_allocate_lock()) != NULL) {
+            dp->wlock = lock;
+        }
+        if ((lock = PyThread_allocate_lock()) != NULL) {
+            dp->idle = lock;
+        }
+        dp->busy = 0;
+        Py_BEGIN_ALLOW_THREADS
+        depot_serial_lock();
+        if (dp->depot && !dpwritable(dp->depot)) {
+            _depot_detach(dp);
+            if ((dp->depot = dpopen(dp->name, dp->omode, dp->bnum)) != NULL) {
+                dpiterinit(dp->depot);
+#ifdef POSIX_FADV_NORMAL
+                if (dp->advice != POSIX_FADV_NORMAL)
+                    posix_fadvise(dpfdesc(dp->depot), 0, 0, dp->advice);
+#endif
+            } else {
+                ecode = dpecode;
+            }
+        } else {
+            dp->orphaned = dp->depot != NULL;
+            _depot_detach(dp);
+        }
+        depot_serial_unlock();
+        Py_END_ALLOW_THREADS
+        dp->forkerr = ecode;
+        dp->itergen++;
+        dp->pid = depot_pid;
+    }
+    pthread_mutex_unlock(&depot_fork);
+}
+
+// ---- Locking
+/* Take a handle lock, letting other threads run while waiting for it */
+static void _depot_acquire(PyThread_type_lock lock)
+{
+    if (!PyThread_acquire_lock(lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* Enter depot_serial with the GIL held (no-op for a reentrant QDBM) */
+static void _depot_serial_acquire(void)
+{
+    if (!depot_reentrant && pthread_mutex_trylock(&depot_serial) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&depot_serial);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void _depot_lock(DepotObject *dp)
+{
+    if (dp->pid != depot_pid) {
+        _depot_afterfork(dp);
+    }
+    _depot_acquire(dp->lock);
+    _depot_serial_acquire();
+}
+
+static void _depot_unlock(DepotObject *dp)
+{
+    depot_serial_unlock();
+    PyThread_release_lock(dp->lock);
+}
+
+/* Mark the file descriptor as in use without `lock', so that close()
+   waits before releasing it.  Both are called with `lock' held. */
+static void _depot_busy(DepotObject *dp)
+{
+    if (dp->busy++ == 0) {
+        PyThread_acquire_lock(dp->idle, NOWAIT_LOCK);
+    }
+}
+
+static void _depot_unbusy(DepotObject *dp)
+{
+    if (--dp->busy == 0) {
+        PyThread_release_lock(dp->idle);
+    }
+}
+
+static void _depot_wlock(DepotObject *dp)
+{
+    if (dp->pid != depot_pid) {
+        _depot_afterfork(dp);
+    }
+    _depot_acquire(dp->wlock);
+}
+
+static void _depot_wunlock(DepotObject *dp)
+{
+    PyThread_release_lock(dp->wlock);
+}
+
+/* Set the exception for a failed QDBM call.  Besides the QDBM error
+   codes, -1 means closed and -2 means the iterator was restarted. */
+static void _depot_seterror(DepotObject *dp, int ecode)
+{
+    if (ecode == -2) {
+        PyErr_SetString(DepotError(dp), DEPOT_ITERRESET_MSG);
+        return;
+    }
+    if (ecode == -1 && dp->orphaned) {
+        PyErr_SetString(DepotError(dp),
+                        "DEPOT object was opened for writing by the parent process");
+        return;
+    }
+    if (ecode == -1 && dp->forkerr != DP_ENOERR) {
+        PyErr_Format(DepotError(dp), "cannot reopen DEPOT object after fork: %s",
+                     dperrmsg(dp->forkerr));
+        return;
+    }
+    PyErr_SetString(DepotError(dp),
+                    ecode == -1 ? DEPOT_CLOSED_MSG : dperrmsg(ecode));
+}
+
 // ---- Basic Functions
-static void _depot_close(DepotObject* self)
+static int _depot_close(DepotObject* self)
 {
+    int rv = 0;
+
+    if (self->log) {
+        rv = depotlog_close(self->log);
+        self->log = NULL;
+    }
     if (self->depot) {
         dpclose(self->depot);
         self->depot = NULL;
     }
+    self->orphaned = 0;
+    self->forkerr = DP_ENOERR;
+    return rv;
 }
 
 static void depot_dealloc(DepotObject* self)
 {
-    _depot_close(self);
+    PyTypeObject *tp = Py_TYPE(self);
+    int inherited = self->pid != depot_pid;
+
+    _depot_serial_acquire();
+    if (inherited) {
+        _depot_detach(self);
+    } else {
+        _depot_close(self);
+    }
+    depot_serial_unlock();
+    /* Inherited locks may be held by parent threads; leave them */
+    if (!inherited) {
+        if (self->lock) {
+            PyThread_free_lock(self->lock);
+        }
+        if (self->wlock) {
+            PyThread_free_lock(self->wlock);
+        }
+        if (self->idle) {
+            PyThread_free_lock(self->idle);
+        }
+    }
+    free(self->name);
     PyObject_Del(self);
+    Py_DECREF(tp);
 }
 
-static int depot_length(DepotObject *dp)
+static Py_ssize_t depot_length(DepotObject *dp)
 {
+    int rnum = -1;
+
+    _depot_lock(dp);
+    if (dp->depot != NULL) {
+        rnum = dprnum(dp->depot);
+    }
+    _depot_unlock(dp);
+    if (rnum == -1) {
+        _depot_seterror(dp, -1);
+    }
+    return rnum;
+}
+
+/* Fetch the value for a key.  Returns a malloc'ed buffer, or NULL with
+   the QDBM error code (-1 if closed) in *ecode. */
+static char *_depot_get(DepotObject *dp, const char *kbuf, int ksiz, int *sp,
+                        int *ecode)
+{
+    char *vbuf = NULL;
+
+    _depot_lock(dp);
     if (dp->depot == NULL) {
-        PyErr_SetString(DepotError, "DEPOT object has already been closed");
-        return -1;
+        *ecode = -1;
+    } else if (!(vbuf = dpget(dp->depot, kbuf, ksiz, 0, -1, sp))) {
+        *ecode = dpecode;
     }
-    return dprnum(dp->depot);
+    _depot_unlock(dp);
+    return vbuf;
 }
 
 static PyObject *depot_subscript(DepotObject *dp, register PyObject *key)
 {
     datum drec, krec;
-    int tmp_size;
+    Py_ssize_t tmp_size;
+    int ecode;
     PyObject *ret;
 
     if (!PyArg_Parse(key, "s#", &krec.dptr, &tmp_size)) {
@@ -80,15 +876,13 @@ static PyObject *depot_subscript(DepotObject *dp, register PyObject *key)
     }
 
     krec.dsize = tmp_size;
-    check_depotobject_open(dp);
-    drec.dptr = dpget(dp->depot, krec.dptr, krec.dsize, 0, -1, &tmp_size);
-    drec.dsize = tmp_size;
+    drec.dptr = _depot_get(dp, krec.dptr, krec.dsize, &drec.dsize, &ecode);
 
     if (!drec.dptr) {
-        if (dpecode == DP_ENOITEM) {
-            PyErr_SetString(PyExc_KeyError, PyUnicode_AsUTF8(key));
+        if (ecode == DP_ENOITEM) {
+            PyErr_SetObject(PyExc_KeyError, key);
         } else {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
+            _depot_seterror(dp, ecode);
         }
         return NULL;
     }
@@ -98,10 +892,90 @@ static PyObject *depot_subscript(DepotObject *dp, register PyObject *key)
     return ret;
 }
 
+/* Write out the change log batch without the GIL; the caller holds the
+   handle lock.  Returns -1 with errno set on error. */
+static int _depot_logflush(DepotObject *dp)
+{
+    int rv, err;
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = depotlog_flush(dp->log);
+    err = errno;
+    Py_END_ALLOW_THREADS
+    errno = err;
+    return rv;
+}
+
+/* Store (vbuf != NULL) or remove a record and log the update.  The
+   record is buffered in the log first, so a failed update is never
+   logged and a failed append (errno in *logerr, DP_EMISC) leaves the
+   database unchanged.  Returns 0, or the QDBM error code (-1 if closed).
+   If the batch cannot be written out afterwards, the update stands:
+   0 is returned with errno in *logerr, and the records stay buffered for
+   the next write. */
+static int _depot_update(DepotObject *dp, const char *kbuf, int ksiz,
+                         const char *vbuf, int vsiz, int *logerr)
+{
+    size_t used = 0;
+    int ecode = 0, rv = 0, ok;
+
+    *logerr = 0;
+    _depot_wlock(dp);
+    _depot_lock(dp);
+    if (dp->depot == NULL) {
+        _depot_unlock(dp);
+        _depot_wunlock(dp);
+        return -1;
+    }
+    if (dp->log) {
+        used = dp->log->used;
+        rv = depotlog_append(dp->log, vbuf ? DEPOTLOG_PUT : DEPOTLOG_OUT,
+                             kbuf, ksiz, vbuf, vbuf ? vsiz : 0);
+    }
+    if (rv == -1) {
+        *logerr = errno;
+        ecode = DP_EMISC;
+    } else {
+        if (vbuf == NULL) {
+            ok = dpout(dp->depot, kbuf, ksiz);
+        } else {
+            ok = dpput(dp->depot, kbuf, ksiz, vbuf, vsiz, DP_DOVER);
+        }
+        if (!ok) {
+            ecode = dpecode;
+            if (dp->log) {
+                depotlog_unappend(dp->log, used);
+            }
+        } else if (rv == 1 && _depot_logflush(dp) == -1) {
+            *logerr = errno;
+        }
+    }
+    _depot_unlock(dp);
+    _depot_wunlock(dp);
+    return ecode;
+}
+
+/* Raise the error for a failed _depot_update(); ecode 0 with logerr set
+   means the update was stored but its log batch is not written yet */
+static void _depot_update_seterror(DepotObject *dp, int ecode, int logerr)
+{
+    if (ecode == 0) {
+        PyErr_Format(get_depot_state(dp)->logerror,
+                     "update stored but not yet written to the change log "
+                     "(%s); flushlog() retries", strerror(logerr));
+    } else if (logerr) {
+        errno = logerr;
+        PyErr_SetFromErrno(DepotError(dp));
+    } else {
+        _depot_seterror(dp, ecode);
+    }
+}
+
 static int depot_ass_sub(DepotObject *dp, PyObject *v, PyObject *w)
 {
     datum krec, drec;
-    int tmp_size;
+    Py_ssize_t tmp_size;
+    int ecode, logerr;
 
     if (!PyArg_Parse(v, "s#", &krec.dptr, &tmp_size)) {
         PyErr_SetString(PyExc_TypeError,
@@ -110,80 +984,157 @@ static int depot_ass_sub(DepotObject *dp, PyObject *v, PyObject *w)
     }
 
     krec.dsize = tmp_size;
-    if (dp->depot == NULL) {
-        PyErr_SetString(DepotError, "DEPOT object has already been closed");
-        return -1;
-    }
-
-    if (w == NULL) {
-        if (dpout(dp->depot, krec.dptr, krec.dsize) == 0) {
-            if (dpecode == DP_ENOITEM) {
-                PyErr_SetString(PyExc_KeyError, PyUnicode_AsUTF8(v));
-            } else {
-                PyErr_SetString(DepotError, dperrmsg(dpecode));
-            }
-            return -1;
-        }
-    } else {
+    drec.dptr = NULL;
+    drec.dsize = 0;
+    if (w != NULL) {
         if (!PyArg_Parse(w, "s#", &drec.dptr, &tmp_size)) {
             PyErr_SetString(PyExc_TypeError,
                             "depot mappings have string elements only");
             return -1;
         }
         drec.dsize = tmp_size;
-        if (dpput(dp->depot, krec.dptr, krec.dsize, drec.dptr, drec.dsize, DP_DOVER) == 0) {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
-            return -1;
-        }
+    }
+
+    ecode = _depot_update(dp, krec.dptr, krec.dsize, drec.dptr, drec.dsize, &logerr);
+    if (ecode == DP_ENOITEM) {
+        PyErr_SetObject(PyExc_KeyError, v);
+        return -1;
+    } else if (ecode != 0 || logerr) {
+        _depot_update_seterror(dp, ecode, logerr);
+        return -1;
     }
     return 0;
 }
 
-static PyMappingMethods depot_as_mapping = {
-    (lenfunc)depot_length,          /*mp_length*/
-    (binaryfunc)depot_subscript,    /*mp_subscript*/
-    (objobjargproc)depot_ass_sub,   /*mp_ass_subscript*/
-};
-
 // ---- methods
 static PyObject *depot_close(register DepotObject *dp, PyObject *args)
 {
+    int rv;
+
     if (!PyArg_ParseTuple(args, ":close")) {
         return NULL;
     }
 
-    _depot_close(dp);
+    _depot_wlock(dp);
+    _depot_lock(dp);
+    while (dp->busy > 0) {
+        /* Wait for warm() to finish reading the file */
+        _depot_unlock(dp);
+        _depot_acquire(dp->idle);
+        PyThread_release_lock(dp->idle);
+        _depot_lock(dp);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    rv = _depot_close(dp);
+    Py_END_ALLOW_THREADS
+    _depot_unlock(dp);
+    _depot_wunlock(dp);
+    if (rv == -1) {
+        return PyErr_SetFromErrno(DepotError(dp));
+    }
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+static PyObject *depot_flushlog(register DepotObject *dp, PyObject *args)
+{
+    int rv = 0, closed;
+
+    if (!PyArg_ParseTuple(args, ":flushlog")) {
+        return NULL;
+    }
+    _depot_lock(dp);
+    closed = dp->depot == NULL;
+    if (!closed && dp->log) {
+        rv = _depot_logflush(dp);
+    }
+    _depot_unlock(dp);
+    if (closed) {
+        _depot_seterror(dp, -1);
+        return NULL;
+    }
+    if (rv == -1) {
+        return PyErr_SetFromErrno(DepotError(dp));
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Restart the handle's record iterator.  QDBM has one cursor per handle,
+   so this also ends any other iteration over it; *gen identifies this
+   one.  Returns 0 or the error code. */
+static int _depot_iterinit(DepotObject *dp, unsigned long *gen)
+{
+    int ecode = 0;
+
+    _depot_lock(dp);
+    if (dp->depot == NULL) {
+        ecode = -1;
+    } else if (!dpiterinit(dp->depot)) {
+        ecode = dpecode;
+    } else {
+        *gen = ++dp->itergen;
+    }
+    _depot_unlock(dp);
+    return ecode;
+}
+
+/* Next key of the handle's record iterator, and its value if vbuf is
+   given.  Returns a malloc'ed key, or NULL with the error code in *ecode
+   (DP_ENOITEM at the end, -2 if the iterator was restarted since gen).
+   If given, *done is set at the end and checked on later calls. */
+static char *_depot_iternext(DepotObject *dp, unsigned long gen, int *done,
+                             int *ksp, char **vbuf, int *vsp, int *ecode)
+{
+    char *kbuf = NULL;
+
+    _depot_lock(dp);
+    if (done && *done) {
+        *ecode = DP_ENOITEM;
+    } else if (dp->depot == NULL) {
+        *ecode = -1;
+    } else if (dp->itergen != gen) {
+        *ecode = -2;
+    } else if (!(kbuf = dpiternext(dp->depot, ksp))) {
+        *ecode = dpecode;
+    } else if (vbuf && !(*vbuf = dpget(dp->depot, kbuf, *ksp, 0, -1, vsp))) {
+        *ecode = dpecode;
+        free(kbuf);
+        kbuf = NULL;
+    }
+    if (kbuf == NULL && done) {
+        *done = 1;
+    }
+    _depot_unlock(dp);
+    return kbuf;
+}
+
 static PyObject *depot_keys(register DepotObject *dp, PyObject *args)
 {
     register PyObject *v, *item;
     datum key;
-    int err, tmp_size;
+    unsigned long gen = 0;
+    int err, ecode;
 
     if (!PyArg_ParseTuple(args, ":keys")) {
         return NULL;
     }
 
-    check_depotobject_open(dp);
-
-    v = PyList_New(0);
-    if (v == NULL) {
+    /* Init Iterator */
+    if ((ecode = _depot_iterinit(dp, &gen)) != 0) {
+        _depot_seterror(dp, ecode);
         return NULL;
     }
 
-    /* Init Iterator */
-    if (!dpiterinit(dp->depot)) {
-        PyErr_SetString(DepotError, dperrmsg(dpecode));
+    v = PyList_New(0);
+    if (v == NULL) {
         return NULL;
     }
 
     /* Scan Iterator */
-    while((key.dptr = dpiternext(dp->depot, &tmp_size)) != NULL) {
-        key.dsize = tmp_size;
+    while((key.dptr = _depot_iternext(dp, gen, NULL, &key.dsize, NULL, NULL, &ecode)) != NULL) {
         item = PyUnicode_FromStringAndSize(key.dptr, key.dsize);
         free(key.dptr);
         if (item == NULL) {
@@ -197,27 +1148,46 @@ static PyObject *depot_keys(register DepotObject *dp, PyObject *args)
             return NULL;
         }
     }
+    if (ecode != DP_ENOITEM) {
+        _depot_seterror(dp, ecode);
+        Py_DECREF(v);
+        return NULL;
+    }
     return v;
 }
 
+/* Size of the value for a key, or -1 with the error code in *ecode */
+static int _depot_vsiz(DepotObject *dp, const char *kbuf, int ksiz, int *ecode)
+{
+    int val = -1;
+
+    _depot_lock(dp);
+    if (dp->depot == NULL) {
+        *ecode = -1;
+    } else if ((val = dpvsiz(dp->depot, kbuf, ksiz)) == -1) {
+        *ecode = dpecode;
+    }
+    _depot_unlock(dp);
+    return val;
+}
+
 static PyObject *depot_has_key(register DepotObject *dp, PyObject *args)
 {
     datum key;
-    int val;
-    int tmp_size;
+    int val, ecode;
+    Py_ssize_t tmp_size;
 
     if (!PyArg_ParseTuple(args, "s#:has_key", &key.dptr, &tmp_size)) {
         return NULL;
     }
     key.dsize = tmp_size;
-    check_depotobject_open(dp);
-    val = dpvsiz(dp->depot, key.dptr, key.dsize);
+    val = _depot_vsiz(dp, key.dptr, key.dsize, &ecode);
     if (val == -1) {
-        if (dpecode == DP_ENOITEM) {
+        if (ecode == DP_ENOITEM) {
             Py_INCREF(Py_False);
             return Py_False;
         } else {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
+            _depot_seterror(dp, ecode);
             return NULL;
         }
     } else {
@@ -229,15 +1199,11 @@ static PyObject *depot_has_key(register DepotObject *dp, PyObject *args)
 static int depot_contains(PyObject *self, PyObject *arg)
 {
     datum key;
-    int val;
+    int val, ecode;
     Py_ssize_t tmp_size;
 
     DepotObject *dp = (DepotObject *)self;
 
-    if (dp->depot == NULL) {
-        PyErr_SetString(DepotError, "DEPOT object has already been closed");
-        return -1;
-    }
     if (PyUnicode_Check(arg)) {
         key.dptr = PyUnicode_AsUTF8AndSize(arg, &tmp_size);
         key.dsize = tmp_size;
@@ -248,8 +1214,12 @@ static int depot_contains(PyObject *self, PyObject *arg)
         return -1;
     }
 
-    val = dpvsiz(dp->depot, key.dptr, key.dsize);
+    val = _depot_vsiz(dp, key.dptr, key.dsize, &ecode);
     if (val == -1) {
+        if (ecode == -1) {
+            _depot_seterror(dp, ecode);
+            return -1;
+        }
         return 0;
     } else {
         return 1;
@@ -260,19 +1230,21 @@ static PyObject *depot_get(register DepotObject *dp, PyObject *args)
 {
     datum key, val;
     PyObject *defvalue = Py_None, *ret;
-    int tmp_size;
+    Py_ssize_t tmp_size;
+    int ecode;
 
     if (!PyArg_ParseTuple(args, "s#|O:get",
                           &key.dptr, &tmp_size, &defvalue)) {
         return NULL;
     }
     key.dsize = tmp_size;
-    check_depotobject_open(dp);
-    val.dptr = dpget(dp->depot, key.dptr, key.dsize, 0, -1, &tmp_size);
-    val.dsize = tmp_size;
+    val.dptr = _depot_get(dp, key.dptr, key.dsize, &val.dsize, &ecode);
     if (val.dptr != NULL) {
         ret = PyUnicode_FromStringAndSize(val.dptr, val.dsize);
         free(val.dptr);
+    } else if (ecode == -1) {
+        _depot_seterror(dp, ecode);
+        ret = NULL;
     } else {
         Py_INCREF(defvalue);
         ret = defvalue;
@@ -285,59 +1257,336 @@ static PyObject *depot_setdefault(register DepotObject *dp, PyObject *args)
 {
     datum key, val;
     PyObject *defvalue = NULL;
-    int tmp_size;
+    Py_ssize_t tmp_size;
+    int ecode, logerr;
 
-    if (!PyArg_ParseTuple(args, "s#|S:setdefault",
+    if (!PyArg_ParseTuple(args, "s#|U:setdefault",
                           &key.dptr, &tmp_size, &defvalue)) {
         return NULL;
     }
-    key.dsize = tmp_size;
-    check_depotobject_open(dp);
-    val.dptr = dpget(dp->depot, key.dptr, key.dsize, 0, -1, &tmp_size);
-    val.dsize = tmp_size;
-    if (val.dptr != NULL) {
-        PyObject *ret;
-        ret = PyUnicode_FromStringAndSize(val.dptr, val.dsize);
-        free(val.dptr);
-        return ret;
+    key.dsize = tmp_size;
+    val.dptr = _depot_get(dp, key.dptr, key.dsize, &val.dsize, &ecode);
+    if (val.dptr != NULL) {
+        PyObject *ret;
+        ret = PyUnicode_FromStringAndSize(val.dptr, val.dsize);
+        free(val.dptr);
+        return ret;
+    } else if (ecode != DP_ENOITEM) {
+        _depot_seterror(dp, ecode);
+        return NULL;
+    }
+
+    if (defvalue == NULL) {
+        defvalue = PyUnicode_FromStringAndSize(NULL, 0);
+        if (defvalue == NULL)
+            return NULL;
+    } else {
+        Py_INCREF(defvalue);
+    }
+
+    if (!(val.dptr = (char *)PyUnicode_AsUTF8AndSize(defvalue, &tmp_size))) {
+        Py_DECREF(defvalue);
+        return NULL;
+    }
+    val.dsize = tmp_size;
+    ecode = _depot_update(dp, key.dptr, key.dsize, val.dptr, val.dsize, &logerr);
+    if (ecode != 0 || logerr) {
+        _depot_update_seterror(dp, ecode, logerr);
+        Py_DECREF(defvalue);
+        return NULL;
+    }
+
+    return defvalue;
+}
+
+static double _depot_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static PyObject *depot_warm(register DepotObject *dp, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"mode", NULL};
+    char *mode = "buckets";
+    char *buf;
+    off_t length = 0, offset = 0;
+    ssize_t n = 0;
+    int fd = -1, all, err = 0;
+    double start, elapsed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s:warm", kwlist, &mode)) {
+        return NULL;
+    }
+    if (strcmp(mode, "buckets") != 0 && strcmp(mode, "all") != 0) {
+        PyErr_SetString(DepotError(dp),
+                        "arg 1 to warm should be 'buckets' or 'all'");
+        return NULL;
+    }
+    all = strcmp(mode, "all") == 0;
+
+    if ((buf = malloc(DEPOT_WARMBUFSIZ)) == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    /* Read through the handle's own descriptor: closing a dup() of it
+       would drop the process's fcntl() lock on the file.  The handle is
+       marked busy so that close() waits for the read to finish. */
+    _depot_lock(dp);
+    if (dp->depot != NULL) {
+        if (all) {
+            length = dpfsiz(dp->depot);
+        } else {
+            length = DEPOT_HEADSIZ + (off_t)dpbnum(dp->depot) * sizeof(int);
+        }
+        fd = dpfdesc(dp->depot);
+        _depot_busy(dp);
+    }
+    _depot_unlock(dp);
+    if (fd == -1) {
+        free(buf);
+        _depot_seterror(dp, -1);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    start = _depot_monotonic();
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+#endif
+    while (offset < length) {
+        n = length - offset;
+        n = pread(fd, buf, n < DEPOT_WARMBUFSIZ ? n : DEPOT_WARMBUFSIZ, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            err = (n == -1) ? errno : 0;
+            break;
+        }
+        offset += n;
+    }
+    elapsed = _depot_monotonic() - start;
+    Py_END_ALLOW_THREADS
+
+    _depot_lock(dp);
+    _depot_unbusy(dp);
+    _depot_unlock(dp);
+    free(buf);
+    if (err) {
+        errno = err;
+        return PyErr_SetFromErrno(DepotError(dp));
+    }
+    return Py_BuildValue("(Ld)", (long long)offset, elapsed);
+}
+
+/* Copy the first `length' bytes of sfd into dfd.  A reflink is tried
+   first, then an in-kernel copy, then plain reads and writes.  Runs
+   without the GIL.  Returns -1 with errno set on error. */
+static int _depot_copyfile(int sfd, int dfd, off_t length)
+{
+    off_t off = 0;
+    ssize_t n = 0;
+    char *buf;
+
+#ifdef FICLONE
+    if (ioctl(dfd, FICLONE, sfd) == 0) {
+        return 0;
+    }
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+    while (off < length) {
+        loff_t in = off, out = off;
+        n = copy_file_range(sfd, &in, dfd, &out, length - off, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (off == 0 && (errno == ENOSYS || errno == EXDEV ||
+                             errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        off += n;
+    }
+    if (off > 0) {
+        return 0;
+    }
+#endif
+    if (!(buf = malloc(DEPOT_COPYBUFSIZ))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (off < length) {
+        n = length - off;
+        n = pread(sfd, buf, n < DEPOT_COPYBUFSIZ ? n : DEPOT_COPYBUFSIZ, off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (pwrite(dfd, buf, n, off) != n) {
+            int err = errno;
+            free(buf);
+            errno = err;
+            return -1;
+        }
+        off += n;
+    }
+    free(buf);
+    return n == -1 ? -1 : 0;
+}
+
+/* Make a rename into the directory of `path' durable.  Best effort: the
+   copy itself has already been synced. */
+static void _depot_syncdir(const char *path)
+{
+    char *dir, *p;
+    int fd;
+
+    if (!(dir = malloc(strlen(path) + 2))) {
+        return;
+    }
+    strcpy(dir, path);
+    if ((p = strrchr(dir, '/')) == NULL) {
+        strcpy(dir, ".");
+    } else {
+        p[p == dir] = '\0';
+    }
+    if ((fd = open(dir, O_RDONLY)) != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+static PyObject *depot_snapshot(register DepotObject *dp, PyObject *args)
+{
+    char *path, *tmppath = NULL;
+    struct stat sbuf, dbuf;
+    depotlogpos next = {0, 0, 0};
+    int sfd = -1, dfd, rv = -1, err = 0, ecode = 0;
+
+    if (!PyArg_ParseTuple(args, "s:snapshot", &path)) {
+        return NULL;
+    }
+
+    /* Updates wait for the lock while the file is synced and copied; with
+       a reflink the copy itself is a metadata-only operation.  Readers
+       of this handle only wait for the sync, and other threads do not
+       wait at all since both steps run without the GIL. */
+    _depot_wlock(dp);
+    _depot_lock(dp);
+    if (dp->depot == NULL) {
+        ecode = -1;
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        if (dp->log && depotlog_flush(dp->log) == -1) {
+            err = errno;
+        } else if (dpwritable(dp->depot) && !dpsync(dp->depot)) {
+            ecode = dpecode;
+        } else if (dp->log &&
+                   (next.offset = lseek(dp->log->fd, 0, SEEK_END)) == -1) {
+            err = errno;
+        } else {
+            next.seq = dp->log ? dp->log->seq + 1 : 0;
+            next.id = dp->log ? dp->log->id : 0;
+            sfd = dpfdesc(dp->depot);
+            if (fstat(sfd, &sbuf) == -1) {
+                err = errno;
+            }
+        }
+        Py_END_ALLOW_THREADS
+    }
+    _depot_unlock(dp);
+    if (ecode) {
+        _depot_seterror(dp, ecode);
+        goto unlock;
+    }
+    if (err) {
+        errno = err;
+        PyErr_SetFromErrno(DepotError(dp));
+        goto unlock;
+    }
+    if (stat(path, &dbuf) == 0 &&
+        dbuf.st_dev == sbuf.st_dev && dbuf.st_ino == sbuf.st_ino) {
+        PyErr_Format(DepotError(dp), "%s is the database being copied", path);
+        goto unlock;
+    }
+
+    /* Copy into a temporary file next to path and rename it into place,
+       so that an interrupted copy never looks like a finished one */
+    if (!(tmppath = PyMem_Malloc(strlen(path) + 8))) {
+        PyErr_NoMemory();
+        goto unlock;
+    }
+    sprintf(tmppath, "%s.XXXXXX", path);
+    if ((dfd = mkstemp(tmppath)) == -1) {
+        PyErr_SetFromErrnoWithFilename(DepotError(dp), path);
+        goto unlock;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = _depot_copyfile(sfd, dfd, sbuf.st_size);
+    if (rv == 0) {
+        rv = fchmod(dfd, 0644);
+    }
+    if (rv == 0) {
+        rv = fsync(dfd);
+    }
+    err = errno;
+    if (close(dfd) == -1 && rv == 0) {
+        rv = -1;
+        err = errno;
+    }
+    if (rv == 0) {
+        if ((rv = rename(tmppath, path)) == 0) {
+            _depot_syncdir(path);
+        } else {
+            err = errno;
+        }
+    }
+    if (rv == -1) {
+        unlink(tmppath);
     }
+    Py_END_ALLOW_THREADS
 
-    if (defvalue == NULL) {
-        defvalue = PyUnicode_FromStringAndSize(NULL, 0);
-        if (defvalue == NULL)
-            return NULL;
-    } else {
-        Py_INCREF(defvalue);
+    if (rv == -1) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(DepotError(dp), path);
     }
 
-    val.dptr = PyUnicode_AsUTF8(defvalue);
-    val.dsize = PyUnicode_GET_SIZE(defvalue);
-    if (!dpput(dp->depot, key.dptr, key.dsize, val.dptr, val.dsize, DP_DOVER)) {
-        PyErr_SetString(DepotError, dperrmsg(dpecode));
+unlock:
+    _depot_wunlock(dp);
+    PyMem_Free(tmppath);
+    if (rv == -1) {
         return NULL;
     }
-
-    return defvalue;
+    return depotlog_posvalue(&next);
 }
 
-extern PyTypeObject PyDepotIterKey_Type;   /* Forward */
-extern PyTypeObject PyDepotIterItem_Type;  /* Forward */
-extern PyTypeObject PyDepotIterValue_Type; /* Forward */
 static PyObject *depotiter_new(DepotObject *, PyTypeObject *);  /* Forward */
 
 static PyObject *depot_iterkeys(DepotObject *dp)
 {
-    return depotiter_new(dp, &PyDepotIterKey_Type);
+    return depotiter_new(dp, get_depot_state(dp)->keyiter_type);
 }
 
 static PyObject *depot_iteritems(DepotObject *dp)
 {
-    return depotiter_new(dp, &PyDepotIterItem_Type);
+    return depotiter_new(dp, get_depot_state(dp)->itemiter_type);
 }
 
 static PyObject *depot_itervalues(DepotObject *dp)
 {
-    return depotiter_new(dp, &PyDepotIterValue_Type);
+    return depotiter_new(dp, get_depot_state(dp)->valueiter_type);
 }
 
 static PyObject *depot__enter__(PyObject *self, PyObject *args)
@@ -348,14 +1597,16 @@ static PyObject *depot__enter__(PyObject *self, PyObject *args)
 
 static PyObject *depot__exit__(PyObject *self, PyObject *args)
 {
-    _Py_IDENTIFIER(close);
-    return _PyObject_CallMethodId(self, &PyId_close, NULL);
+    return PyObject_CallMethod(self, "close", NULL);
 }
 
 
 static PyMethodDef depot_methods[] = {
     {"close", (PyCFunction)depot_close, METH_VARARGS,
      "close()\nClose the database."},
+    {"flushlog", (PyCFunction)depot_flushlog, METH_VARARGS,
+     "flushlog()\nWrite out change log records still held in the batch buffer,\n"
+     "e.g. after an update raised depot.LogError."},
     {"listkeys", (PyCFunction)depot_keys, METH_VARARGS,
      "listkeys() -> list\nReturn a list of all keys in the database."},
     {"has_key", (PyCFunction)depot_has_key, METH_VARARGS,
@@ -367,6 +1618,14 @@ static PyMethodDef depot_methods[] = {
      "setdefault(key[, default]) -> value\n"
      "Set the value for key into the database.  If key\n"
      "is not in the database, it is inserted with default as the value."},
+    {"warm", (PyCFunction)depot_warm, METH_VARARGS | METH_KEYWORDS,
+     "warm([mode]) -> (bytes, seconds)\n"
+     "Read the bucket array ('buckets', default) or the whole file ('all')\n"
+     "into the page cache."},
+    {"snapshot", (PyCFunction)depot_snapshot, METH_VARARGS,
+     "snapshot(path) -> (seq, offset, id)\n"
+     "Write a consistent copy of the database to path.  Return the change log\n"
+     "position to pass to apply() to bring the copy up to date."},
     {"keys", (PyCFunction)depot_iterkeys, METH_NOARGS,
      "keys() -> an iterator over the keys"},
     {"items", (PyCFunction)depot_iteritems, METH_NOARGS,
@@ -384,66 +1643,84 @@ static PyMethodDef depot_methods[] = {
 
 typedef struct {
     PyObject_HEAD
-    DepotObject *depot;   /* Set to NULL when iterator is exhausted */
+    DepotObject *depot;
+    int exhausted;        /* Set under the handle lock at the end */
+    unsigned long gen;    /* the handle's itergen when this iterator began */
     PyObject* di_result;  /* reusable result tuple for iteritems */
 } depotiterobject;
 
+typedef struct {
+    PyObject_HEAD
+    depotlogreader rd;
+    depotlogpos pos;      /* next record to return */
+} depotlogiterobject;
+
 static PyObject *depotiter_new(DepotObject *dp, PyTypeObject *itertype)
 {
     depotiterobject *di;
+    unsigned long gen = 0;
+    int ecode;
+
+    if ((ecode = _depot_iterinit(dp, &gen)) != 0) {
+        _depot_seterror(dp, ecode);
+        return NULL;
+    }
     di = PyObject_New(depotiterobject, itertype);
     if (di == NULL) {
         return NULL;
     }
     Py_INCREF(dp);
     di->depot = dp;
-    dpiterinit(dp->depot);
+    di->exhausted = 0;
+    di->gen = gen;
+    di->di_result = NULL;
 
-    if (itertype == &PyDepotIterItem_Type) {
+#ifndef Py_GIL_DISABLED
+    /* Without the GIL another thread may still hold the last result */
+    if (itertype == get_depot_state(dp)->itemiter_type) {
         di->di_result = PyTuple_Pack(2, Py_None, Py_None);
         if (di->di_result == NULL) {
             Py_DECREF(di);
             return NULL;
         }
-    } else {
-        di->di_result = NULL;
     }
+#endif
     return (PyObject *)di;
 }
 
 static void depotiter_dealloc(depotiterobject *di)
 {
+    PyTypeObject *tp = Py_TYPE(di);
+
     Py_XDECREF(di->depot);
     Py_XDECREF(di->di_result);
     PyObject_Del(di);
+    Py_DECREF(tp);
 }
 
-static PySequenceMethods depotiter_as_sequence = {
-    0, /* sq_concat */
-};
+/* Next key (and value if vbuf is given) for an iterator, or NULL at the
+   end or with an exception set */
+static char *_depotiter_next(depotiterobject *di, int *ksp, char **vbuf, int *vsp)
+{
+    DepotObject *d = di->depot;
+    char *kbuf;
+    int ecode;
 
+    kbuf = _depot_iternext(d, di->gen, &di->exhausted, ksp, vbuf, vsp, &ecode);
+    if (kbuf == NULL && ecode != DP_ENOITEM) {
+        _depot_seterror(d, ecode);
+    }
+    return kbuf;
+}
 
 static PyObject *depotiter_iternextkey(depotiterobject *di)
 {
     datum key;
-    DepotObject *d = di->depot;
-    int tmp_size;
     PyObject *ret;
 
-    if (d == NULL) {
-        return NULL;
-    }
-    assert(is_depotobject(d));
-
-    if (!(key.dptr = dpiternext(d->depot, &tmp_size))) {
-        if (dpecode != DP_ENOITEM) {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
-        }
-        Py_DECREF(d);
-        di->depot = NULL;
+    if (!(key.dptr = _depotiter_next(di, &key.dsize, NULL, NULL))) {
         return NULL;
     }
-    key.dsize = tmp_size;
 
     ret = PyUnicode_FromStringAndSize(key.dptr, key.dsize);
     free(key.dptr);
@@ -455,229 +1732,372 @@ static PyObject *depotiter_iternextitem(depotiterobject *di)
 {
     datum key, val;
     PyObject *pykey, *pyval, *result = di->di_result;
-    int tmp_size;
-    DepotObject *d = di->depot;
 
-    if (d == NULL)
+    if (!(key.dptr = _depotiter_next(di, &key.dsize, &val.dptr, &val.dsize))) {
         return NULL;
-    assert(is_depotobject(d));
-
-    if (!(key.dptr = dpiternext(d->depot, &tmp_size))) {
-        if (dpecode != DP_ENOITEM) {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
-        }
-        goto fail;
     }
-    key.dsize = tmp_size;
     pykey = PyUnicode_FromStringAndSize(key.dptr, key.dsize);
-
-    if (!(val.dptr = dpget(d->depot, key.dptr, key.dsize, 0, -1, &tmp_size))) {
-        PyErr_SetString(DepotError, dperrmsg(dpecode));
-        free(key.dptr);
-        Py_DECREF(pykey);
-        goto fail;
-    }
-    val.dsize = tmp_size;
     pyval = PyUnicode_FromStringAndSize(val.dptr, val.dsize);
     free(key.dptr);
     free(val.dptr);
+    if (pykey == NULL || pyval == NULL) {
+        Py_XDECREF(pykey);
+        Py_XDECREF(pyval);
+        return NULL;
+    }
 
-    if (result->ob_refcnt == 1) {
+    if (result != NULL && Py_REFCNT(result) == 1) {
         Py_INCREF(result);
         Py_DECREF(PyTuple_GET_ITEM(result, 0));
         Py_DECREF(PyTuple_GET_ITEM(result, 1));
     } else {
         result = PyTuple_New(2);
-        if (result == NULL)
+        if (result == NULL) {
+            Py_DECREF(pykey);
+            Py_DECREF(pyval);
             return NULL;
+        }
     }
 
     PyTuple_SET_ITEM(result, 0, pykey);
     PyTuple_SET_ITEM(result, 1, pyval);
     return result;
-
-fail:
-    Py_DECREF(d);
-    di->depot = NULL;
-    return NULL;
 }
 
 static PyObject *depotiter_iternextvalue(depotiterobject *di)
 {
     datum key, val;
     PyObject *pyval;
-    int tmp_size;
-    DepotObject *d = di->depot;
 
-    if (d == NULL) {
+    if (!(key.dptr = _depotiter_next(di, &key.dsize, &val.dptr, &val.dsize))) {
         return NULL;
     }
-    assert(is_depotobject(d));
-
-    if (!(key.dptr = dpiternext(d->depot, &tmp_size))) {
-        if (dpecode != DP_ENOITEM) {
-            PyErr_SetString(DepotError, dperrmsg(dpecode));
-        }
-        goto fail;
-    }
-    key.dsize = tmp_size;
-
-    if (!(val.dptr = dpget(d->depot, key.dptr, key.dsize, 0, -1, &tmp_size))) {
-        PyErr_SetString(DepotError, dperrmsg(dpecode));
-        free(key.dptr);
-        goto fail;
-    }
-    val.dsize = tmp_size;
     pyval = PyUnicode_FromStringAndSize(val.dptr, val.dsize);
     free(key.dptr);
     free(val.dptr);
 
     return pyval;
-
-fail:
-    Py_DECREF(d);
-    di->depot = NULL;
-    return NULL;
 }
 
-static PySequenceMethods depot_as_sequence = {
-    0,                      /* sq_length */
-    0,                      /* sq_concat */
-    0,                      /* sq_repeat */
-    0,                      /* sq_item */
-    0,                      /* sq_slice */
-    0,                      /* sq_ass_item */
-    0,                      /* sq_ass_slice */
-    depot_contains,         /* sq_contains */
-    0,                      /* sq_inplace_concat */
-    0,                      /* sq_inplace_repeat */
-};
 
+static PyType_Slot depot_slots[] = {
+    {Py_tp_dealloc, depot_dealloc},
+    {Py_sq_contains, depot_contains},
+    {Py_mp_length, depot_length},
+    {Py_mp_subscript, depot_subscript},
+    {Py_mp_ass_subscript, depot_ass_sub},
+    {Py_tp_iter, depot_iterkeys},
+    {Py_tp_methods, depot_methods},
+    {0, 0},
+};
 
-static PyTypeObject DepotType = {
-    PyVarObject_HEAD_INIT(0, 0)
+static PyType_Spec depot_spec = {
     "depot.depot",
     sizeof(DepotObject),
     0,
-    (destructor)depot_dealloc,          /*tp_dealloc*/
-    0,                                  /*tp_print*/
-    0,                                  /*tp_getattr*/
-    0,                                  /*tp_setattr*/
-    0,                                  /*tp_reserved*/
-    0,                                  /*tp_repr*/
-    0,                                  /*tp_as_number*/
-    &depot_as_sequence,                 /*tp_as_sequence*/
-    &depot_as_mapping,                  /*tp_as_mapping*/
-    0,                                  /*tp_hash*/
-    0,                                  /*tp_call*/
-    0,                                  /*tp_str*/
-    0,                                  /*tp_getattro*/
-    0,                                  /*tp_setattro*/
-    0,                                  /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,                 /*tp_xxx4*/
-    0,                                  /*tp_doc*/
-    0,                                  /*tp_traverse*/
-    0,                                  /*tp_clear*/
-    0,                                  /*tp_richcompare*/
-    0,                                  /*tp_weaklistoffset*/
-    (getiterfunc)depot_iterkeys,        /*tp_iter*/
-    (iternextfunc )depotiter_iternextvalue,  /*tp_iternext*/
-    depot_methods,                      /*tp_methods*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE,
+    depot_slots,
+};
+
+static PyType_Slot depotiterkey_slots[] = {
+    {Py_tp_dealloc, depotiter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, depotiter_iternextkey},
+    {0, 0},
+};
+
+static PyType_Slot depotiteritem_slots[] = {
+    {Py_tp_dealloc, depotiter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, depotiter_iternextitem},
+    {0, 0},
+};
+
+static PyType_Slot depotitervalue_slots[] = {
+    {Py_tp_dealloc, depotiter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, depotiter_iternextvalue},
+    {0, 0},
+};
+
+#define DEPOTITER_FLAGS \
+    (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION | Py_TPFLAGS_IMMUTABLETYPE)
+
+static PyType_Spec depotiterkey_spec = {
+    "depot.keyiterator", sizeof(depotiterobject), 0,
+    DEPOTITER_FLAGS, depotiterkey_slots,
+};
+
+static PyType_Spec depotiteritem_spec = {
+    "depot.itemiterator", sizeof(depotiterobject), 0,
+    DEPOTITER_FLAGS, depotiteritem_slots,
+};
+
+static PyType_Spec depotitervalue_spec = {
+    "depot.valueiterator", sizeof(depotiterobject), 0,
+    DEPOTITER_FLAGS, depotitervalue_slots,
+};
+
+
+/* ----------------------------------------------------------------- */
+/* Change log iterator                                               */
+/* ----------------------------------------------------------------- */
+
+static PyObject *depotlogiter_position(depotlogiterobject *it, void *closure)
+{
+    PyObject *ret;
+
+    Py_BEGIN_CRITICAL_SECTION(it);
+    ret = depotlog_posvalue(&it->pos);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+static void depotlogiter_dealloc(depotlogiterobject *it)
+{
+    PyTypeObject *tp = Py_TYPE(it);
+
+    depotlog_reader_close(&it->rd);
+    PyObject_Del(it);
+    Py_DECREF(tp);
+}
+
+static PyObject *depotlogiter_iternext(depotlogiterobject *it)
+{
+    PyObject *item = NULL;
+    depotlogreader *rd = &it->rd;
+    int rv;
+
+    Py_BEGIN_CRITICAL_SECTION(it);
+    while ((rv = depotlog_reader_next(rd, it->pos.seq)) == 1) {
+        it->pos.offset = rd->end;
+        if (rd->seq < it->pos.seq) {
+            continue;
+        }
+        item = Py_BuildValue("(Kss#z#)", rd->seq,
+                             rd->op == DEPOTLOG_OUT ? "out" : "put",
+                             rd->kbuf, (Py_ssize_t)rd->ksiz,
+                             rd->op == DEPOTLOG_OUT ? NULL : rd->vbuf,
+                             (Py_ssize_t)rd->vsiz);
+        if (item != NULL) {
+            it->pos.seq = rd->seq + 1;
+        }
+        break;
+    }
+    if (rv == 0) {
+        /* Release the file; the position stays valid */
+        depotlog_reader_close(rd);
+    }
+    Py_END_CRITICAL_SECTION();
+    return item;
+}
+
+static PyGetSetDef depotlogiter_getset[] = {
+    {"position", (getter)depotlogiter_position, NULL,
+     "(seq, offset, id) to pass as from to tail() or apply() to continue"},
+    {NULL} /* sentinel */
+};
+
+static PyType_Slot depotlogiter_slots[] = {
+    {Py_tp_dealloc, depotlogiter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, depotlogiter_iternext},
+    {Py_tp_getset, depotlogiter_getset},
+    {0, 0},
 };
 
-PyTypeObject PyDepotIterKey_Type = {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "depoty-keyiterator",           /* tp_name */
-    sizeof(depotiterobject),        /* tp_basicsize */
-    0,                              /* tp_itemsize */
-    /* methods */
-    (destructor)depotiter_dealloc,  /* tp_dealloc */
-    0,                              /* tp_print */
-    0,                              /* tp_getattr */
-    0,                              /* tp_setattr */
-    0,                              /* tp_compare */
-    0,                              /* tp_repr */
-    0,                              /* tp_as_number */
-    &depotiter_as_sequence,         /* tp_as_sequence */
-    0,                              /* tp_as_mapping */
-    0,                              /* tp_hash */
-    0,                              /* tp_call */
-    0,                              /* tp_str */
-    PyObject_GenericGetAttr,        /* tp_getattro */
-    0,                              /* tp_setattro */
-    0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
-    0,                              /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
-    0,                              /* tp_richcompare */
-    0,                              /* tp_weaklistoffset */
-    PyObject_SelfIter,              /* tp_iter */
-    (iternextfunc)depotiter_iternextkey, /* tp_iternext */
+static PyType_Spec depotlogiter_spec = {
+    "depot.logiterator", sizeof(depotlogiterobject), 0,
+    DEPOTITER_FLAGS, depotlogiter_slots,
 };
 
 
-PyTypeObject PyDepotIterItem_Type = {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "depot-itemiterator",           /* tp_name */
-
-    sizeof(depotiterobject),        /* tp_basicsize */
-    0,                              /* tp_itemsize */
-    /* methods */
-    (destructor)depotiter_dealloc,  /* tp_dealloc */
-    0,                              /* tp_print */
-    0,                              /* tp_getattr */
-    0,                              /* tp_setattr */
-    0,                              /* tp_compare */
-    0,                              /* tp_repr */
-    0,                              /* tp_as_number */
-    &depotiter_as_sequence,         /* tp_as_sequence */
-    0,                              /* tp_as_mapping */
-    0,                              /* tp_hash */
-    0,                              /* tp_call */
-    0,                              /* tp_str */
-    PyObject_GenericGetAttr,        /* tp_getattro */
-    0,                              /* tp_setattro */
-    0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
-    0,                              /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
-    0,                              /* tp_richcompare */
-    0,                              /* tp_weaklistoffset */
-    PyObject_SelfIter,              /* tp_iter */
-    (iternextfunc)depotiter_iternextitem, /* tp_iternext */
+/* ----------------------------------------------------------------- */
+/* Reader pool                                                       */
+/* ----------------------------------------------------------------- */
+
+static PyObject *readerpool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "n", "access", "lock", NULL};
+    struct module_state *st = PyType_GetModuleState(type);
+    char *path;
+    char *access = NULL;
+    char *lock = NULL;
+    int n, i;
+    int omode = DP_OREADER;
+    int advice;
+    ReaderPoolObject *pool;
+    PyObject *dp;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "si|zz:ReaderPool", kwlist,
+                                     &path, &n, &access, &lock)) {
+        return NULL;
+    }
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError, "ReaderPool needs at least one handle");
+        return NULL;
+    }
+    if (_depot_openopts(st, access, lock, &omode, &advice) == -1) {
+        return NULL;
+    }
+
+    pool = (ReaderPoolObject *)type->tp_alloc(type, 0);
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->next = 0;
+    pool->assigned = PyDict_New();
+    pool->handles = PyTuple_New(n);
+    if (pool->assigned == NULL || pool->handles == NULL) {
+        Py_DECREF(pool);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (!(dp = depot_new(st, path, omode, -1, advice))) {
+            Py_DECREF(pool);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pool->handles, i, dp);
+    }
+    return (PyObject *)pool;
+}
+
+static void readerpool_dealloc(ReaderPoolObject *pool)
+{
+    PyTypeObject *tp = Py_TYPE(pool);
+
+    Py_XDECREF(pool->handles);
+    Py_XDECREF(pool->assigned);
+    tp->tp_free(pool);
+    Py_DECREF(tp);
+}
+
+/* The calling thread's handle (borrowed).  A thread keeps the handle it
+   was first given; handles are given out round robin. */
+static DepotObject *_readerpool_handle(ReaderPoolObject *pool)
+{
+    PyObject *ident, *index;
+    Py_ssize_t i = -1;
+
+    ident = PyLong_FromUnsignedLong(PyThread_get_thread_ident());
+    if (ident == NULL) {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(pool);
+    index = PyDict_GetItemWithError(pool->assigned, ident);
+    if (index != NULL) {
+        i = PyLong_AsSsize_t(index);
+    } else if (!PyErr_Occurred()) {
+        i = pool->next;
+        if ((index = PyLong_FromSsize_t(i)) == NULL ||
+            PyDict_SetItem(pool->assigned, ident, index) == -1) {
+            i = -1;
+        } else {
+            pool->next = (i + 1) % PyTuple_GET_SIZE(pool->handles);
+        }
+        Py_XDECREF(index);
+    }
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(ident);
+    if (i == -1) {
+        return NULL;
+    }
+    return (DepotObject *)PyTuple_GET_ITEM(pool->handles, i);
+}
+
+static PyObject *readerpool_handle(ReaderPoolObject *pool, PyObject *args)
+{
+    DepotObject *dp;
+
+    if (!(dp = _readerpool_handle(pool))) {
+        return NULL;
+    }
+    Py_INCREF(dp);
+    return (PyObject *)dp;
+}
+
+static PyObject *readerpool_subscript(ReaderPoolObject *pool, PyObject *key)
+{
+    DepotObject *dp;
+
+    if (!(dp = _readerpool_handle(pool))) {
+        return NULL;
+    }
+    return depot_subscript(dp, key);
+}
+
+static int readerpool_contains(ReaderPoolObject *pool, PyObject *key)
+{
+    DepotObject *dp;
+
+    if (!(dp = _readerpool_handle(pool))) {
+        return -1;
+    }
+    return depot_contains((PyObject *)dp, key);
+}
+
+static PyObject *readerpool_get(ReaderPoolObject *pool, PyObject *args)
+{
+    DepotObject *dp;
+
+    if (!(dp = _readerpool_handle(pool))) {
+        return NULL;
+    }
+    return depot_get(dp, args);
+}
+
+static PyObject *readerpool_close(ReaderPoolObject *pool, PyObject *args)
+{
+    PyObject *ret;
+    Py_ssize_t i;
+
+    for (i = 0; i < PyTuple_GET_SIZE(pool->handles); i++) {
+        ret = PyObject_CallMethod(PyTuple_GET_ITEM(pool->handles, i), "close", NULL);
+        if (ret == NULL) {
+            return NULL;
+        }
+        Py_DECREF(ret);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *readerpool__exit__(PyObject *self, PyObject *args)
+{
+    return PyObject_CallMethod(self, "close", NULL);
+}
+
+static PyMethodDef readerpool_methods[] = {
+    {"handle", (PyCFunction)readerpool_handle, METH_NOARGS,
+     "handle() -> mapping\nReturn the calling thread's database object."},
+    {"get", (PyCFunction)readerpool_get, METH_VARARGS,
+     "get(key[, default]) -> value\n"
+     "Return the value for key if present, otherwise default."},
+    {"close", (PyCFunction)readerpool_close, METH_NOARGS,
+     "close()\nClose every database object in the pool."},
+    {"__enter__", depot__enter__, METH_NOARGS, NULL},
+    {"__exit__",  readerpool__exit__, METH_VARARGS, NULL},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyType_Slot readerpool_slots[] = {
+    {Py_tp_new, readerpool_new},
+    {Py_tp_dealloc, readerpool_dealloc},
+    {Py_mp_subscript, readerpool_subscript},
+    {Py_sq_contains, readerpool_contains},
+    {Py_tp_methods, readerpool_methods},
+    {Py_tp_doc, "ReaderPool(path, n[, access[, lock]])\n"
+                "Read-only database objects for path, one per thread."},
+    {0, 0},
 };
 
-PyTypeObject PyDepotIterValue_Type = {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "depot-valueiterator",          /* tp_name */
-    sizeof(depotiterobject),        /* tp_basicsize */
-    0,                              /* tp_itemsize */
-    /* methods */
-    (destructor)depotiter_dealloc,  /* tp_dealloc */
-    0,                              /* tp_print */
-    0,                              /* tp_getattr */
-    0,                              /* tp_setattr */
-    0,                              /* tp_compare */
-    0,                              /* tp_repr */
-    0,                              /* tp_as_number */
-    &depotiter_as_sequence,         /* tp_as_sequence */
-    0,                              /* tp_as_mapping */
-    0,                              /* tp_hash */
-    0,                              /* tp_call */
-    0,                              /* tp_str */
-    PyObject_GenericGetAttr,        /* tp_getattro */
-    0,                              /* tp_setattro */
-    0,                              /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,             /* tp_flags */
-    0,                              /* tp_doc */
-    0,                              /* tp_traverse */
-    0,                              /* tp_clear */
-    0,                              /* tp_richcompare */
-    0,                              /* tp_weaklistoffset */
-    PyObject_SelfIter,              /* tp_iter */
-    (iternextfunc)depotiter_iternextvalue, /* tp_iternext */
+static PyType_Spec readerpool_spec = {
+    "depot.ReaderPool",
+    sizeof(ReaderPoolObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    readerpool_slots,
 };
 
 
@@ -686,14 +2106,26 @@ PyTypeObject PyDepotIterValue_Type = {
 /* ----------------------------------------------------------------- */
 
 static PyObject *
-depotopen(PyObject *self, PyObject *args)
+depotopen(PyObject *self, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {"path", "flag", "size", "access",
+                             "log", "log_batch", "log_fsync", "lock", NULL};
     char *name;
     char *flags = "r";
+    char *access = NULL;
+    char *lock = NULL;
+    char *logpath = NULL;
     int size = -1;
     int iflags;
+    int advice = 0;
+    int logbatch = 1;
+    int logsync = 0;
+    struct module_state *st = get_module_state(self);
+    DepotObject *dp;
 
-    if (!PyArg_ParseTuple(args, "s|si:open", &name, &flags, &size))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sizzipz:open", kwlist,
+                                     &name, &flags, &size, &access,
+                                     &logpath, &logbatch, &logsync, &lock))
         return NULL;
     switch (flags[0]) {
         case 'r':
@@ -709,51 +2141,211 @@ depotopen(PyObject *self, PyObject *args)
             iflags = DP_OWRITER | DP_OCREAT | DP_OSPARSE | DP_OTRUNC;
             break;
         default:
-            PyErr_SetString(DepotError,
+            PyErr_SetString(st->error,
                             "arg 2 to open should be 'r', 'w', 'c', or 'n'");
             return NULL;
     }
-    return depot_new(name, iflags, size);
+    if (_depot_openopts(st, access, lock, &iflags, &advice) == -1)
+        return NULL;
+    if (logpath != NULL && !(iflags & DP_OWRITER)) {
+        PyErr_SetString(st->error, "a change log requires a writable database");
+        return NULL;
+    }
+    dp = (DepotObject *)depot_new(st, name, iflags, size, advice);
+    if (dp == NULL || logpath == NULL)
+        return (PyObject *)dp;
+    if (!(dp->log = depotlog_open(logpath, logbatch, logsync, st->error))) {
+        Py_DECREF(dp);
+        return NULL;
+    }
+    return (PyObject *)dp;
 }
 
-struct module_state {
-    PyObject *error;
-};
+static PyObject *
+depottail(PyObject *self, PyObject *args)
+{
+    struct module_state *st = get_module_state(self);
+    char *path;
+    depotlogpos pos = {0, 0, 0};
+    depotlogiterobject *it;
+
+    if (!PyArg_ParseTuple(args, "s|O&:tail", &path, depotlog_posconv, &pos))
+        return NULL;
+    it = PyObject_New(depotlogiterobject, st->logiter_type);
+    if (it == NULL)
+        return NULL;
+    it->pos = pos;
+    if (depotlog_reader_open(&it->rd, path, st->error) == -1) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    if (depotlog_reader_seek(&it->rd, &it->pos) == -1) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    it->pos.offset = it->rd.end;
+    it->pos.id = it->rd.id;
+    return (PyObject *)it;
+}
+
+static PyObject *
+depotapply(PyObject *self, PyObject *args)
+{
+    struct module_state *st = get_module_state(self);
+    DepotObject *dp;
+    char *path;
+    depotlogpos pos = {0, 0, 0};
+    depotlogreader rd;
+    int rv, ecode, logerr;
+
+    if (!PyArg_ParseTuple(args, "O!s|O&:apply", st->depot_type, &dp, &path,
+                          depotlog_posconv, &pos))
+        return NULL;
+    if (depotlog_reader_open(&rd, path, st->error) == -1)
+        return NULL;
+    if (depotlog_reader_seek(&rd, &pos) == -1) {
+        depotlog_reader_close(&rd);
+        return NULL;
+    }
+    while ((rv = depotlog_reader_next(&rd, pos.seq)) == 1) {
+        if (rd.seq < pos.seq)
+            continue;
+        /* Updates are also chained into the replica's own log, if any */
+        ecode = _depot_update(dp, rd.kbuf, rd.ksiz,
+                              rd.op == DEPOTLOG_OUT ? NULL : rd.vbuf, rd.vsiz,
+                              &logerr);
+        if ((ecode != 0 || logerr) &&
+            !(ecode == DP_ENOITEM && rd.op == DEPOTLOG_OUT)) {
+            _depot_update_seterror(dp, ecode, logerr);
+            rv = -1;
+            break;
+        }
+        pos.seq = rd.seq + 1;
+    }
+    pos.offset = rd.end;
+    pos.id = rd.id;
+    depotlog_reader_close(&rd);
+    if (rv == -1)
+        return NULL;
+    return depotlog_posvalue(&pos);
+}
 
 static PyMethodDef depotmodule_methods[] = {
-    { "open", (PyCFunction)depotopen, METH_VARARGS,
-      "open(path[, flag[, size]]) -> mapping\n"
+    { "open", (PyCFunction)depotopen, METH_VARARGS | METH_KEYWORDS,
+      "open(path[, flag[, size[, access[, log[, log_batch[, log_fsync[, lock]]]]]]]) -> mapping\n"
       "Return a database object."},
+    { "tail", (PyCFunction)depottail, METH_VARARGS,
+      "tail(log[, from]) -> iterator\n"
+      "Iterate over (seq, op, key, value) for the change log records from\n"
+      "from on.  from is a sequence number or a (seq, offset, id) position;\n"
+      "the iterator's position attribute is where to continue next time.\n"
+      "Raise depot.error if the log was replaced or has a gap since."},
+    { "apply", (PyCFunction)depotapply, METH_VARARGS,
+      "apply(db, log[, from]) -> (seq, offset, id)\n"
+      "Replay the change log records from from on into db.  Raise\n"
+      "depot.error if the log was replaced or has a gap since from.\n"
+      "Return the position to pass as from next time."},
     { 0, 0 },
 };
 
+static int depotmodule_exec(PyObject *m)
+{
+    struct module_state *st = get_module_state(m);
+
+    pthread_once(&depot_once, depot_init);
+    st->depot_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &depot_spec, NULL);
+    if (st->depot_type == NULL)
+        return -1;
+    st->keyiter_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &depotiterkey_spec, NULL);
+    if (st->keyiter_type == NULL)
+        return -1;
+    st->itemiter_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &depotiteritem_spec, NULL);
+    if (st->itemiter_type == NULL)
+        return -1;
+    st->valueiter_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &depotitervalue_spec, NULL);
+    if (st->valueiter_type == NULL)
+        return -1;
+    st->readerpool_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &readerpool_spec, NULL);
+    if (st->readerpool_type == NULL)
+        return -1;
+    if (PyModule_AddType(m, st->readerpool_type) < 0)
+        return -1;
+    st->logiter_type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &depotlogiter_spec, NULL);
+    if (st->logiter_type == NULL)
+        return -1;
+    st->error = PyErr_NewException("depot.error", NULL, NULL);
+    if (st->error == NULL)
+        return -1;
+    if (PyModule_AddObjectRef(m, "error", st->error) < 0)
+        return -1;
+    st->logerror = PyErr_NewException("depot.LogError", st->error, NULL);
+    if (st->logerror == NULL)
+        return -1;
+    if (PyModule_AddObjectRef(m, "LogError", st->logerror) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int depotmodule_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    struct module_state *st = get_module_state(m);
+
+    Py_VISIT(st->error);
+    Py_VISIT(st->logerror);
+    Py_VISIT(st->depot_type);
+    Py_VISIT(st->keyiter_type);
+    Py_VISIT(st->itemiter_type);
+    Py_VISIT(st->valueiter_type);
+    Py_VISIT(st->readerpool_type);
+    Py_VISIT(st->logiter_type);
+    return 0;
+}
+
+static int depotmodule_clear(PyObject *m)
+{
+    struct module_state *st = get_module_state(m);
+
+    Py_CLEAR(st->error);
+    Py_CLEAR(st->logerror);
+    Py_CLEAR(st->depot_type);
+    Py_CLEAR(st->keyiter_type);
+    Py_CLEAR(st->itemiter_type);
+    Py_CLEAR(st->valueiter_type);
+    Py_CLEAR(st->readerpool_type);
+    Py_CLEAR(st->logiter_type);
+    return 0;
+}
+
+static void depotmodule_free(void *m)
+{
+    depotmodule_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot depotmodule_slots[] = {
+    {Py_mod_exec, depotmodule_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL},
+};
+
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
     "depot",
     NULL,
     sizeof(struct module_state),
     depotmodule_methods,
-    NULL,
-    NULL, //depotmodule_traverse,
-    NULL, //depotmodule_clear,
-    NULL
+    depotmodule_slots,
+    depotmodule_traverse,
+    depotmodule_clear,
+    depotmodule_free
 };
 
 PyMODINIT_FUNC
 PyInit_depot(void) {
-    PyObject *m, *d;
-
-    if (PyType_Ready(&DepotType) < 0)
-        return NULL;
-    m = PyModule_Create(&moduledef);
-    if (m == NULL)
-        return NULL;
-    d = PyModule_GetDict(m);
-    if (DepotError == NULL)
-        DepotError = PyErr_NewException("depot.error", NULL, NULL);
-    if (DepotError != NULL)
-        PyDict_SetItemString(d, "error", DepotError);
-
-    return m;
+    return PyModuleDef_Init(&moduledef);
 }
-
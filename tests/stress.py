@@ -0,0 +1,188 @@
+"""Multi-thread stress test for qdbm.depot.
+
+Runs mixed read/write/iterate workloads with 1, 2, 4, ... threads and
+prints the throughput for each thread count.  Results are checked against
+an in-memory model; any mismatch or unexpected exception fails the run.
+
+    python tests/stress.py [--threads 1,2,4,8] [--seconds 2] [--records 10000]
+
+Run it with a free-threaded interpreter (e.g. python3.13t) to see the
+handles scale without the GIL.
+"""
+
+import argparse
+import os
+import random
+import shutil
+import sys
+import sysconfig
+import tempfile
+import threading
+import time
+
+from qdbm import depot
+
+
+def shared_handle(db, tid, deadline, rng):
+    """Mixed operations from every thread on one writable handle.  Each
+    thread owns its own keys, so the result can be checked exactly."""
+    model = {}
+    ops = 0
+    while time.perf_counter() < deadline:
+        key = "s%d-%d" % (tid, rng.randrange(500))
+        r = rng.random()
+        if r < 0.25:
+            value = str(ops)
+            db[key] = value
+            model[key] = value
+        elif r < 0.30:
+            try:
+                del db[key]
+            except KeyError:
+                if key in model:
+                    raise AssertionError("%s missing" % key)
+            else:
+                if model.pop(key, None) is None:
+                    raise AssertionError("%s should be missing" % key)
+        elif r < 0.65:
+            if db.get(key) != model.get(key):
+                raise AssertionError("%s has the wrong value" % key)
+        else:
+            if (key in db) != (key in model):
+                raise AssertionError("%s membership is wrong" % key)
+        ops += 1
+    for key, value in model.items():
+        if db[key] != value:
+            raise AssertionError("%s has the wrong value at the end" % key)
+    return ops
+
+
+def own_handle(path, tid, deadline, rng):
+    """Mixed operations and full iterations on a handle of the thread's own."""
+    model = {}
+    ops = 0
+    with depot.open(path, "n") as db:
+        while time.perf_counter() < deadline:
+            key = "o%d" % rng.randrange(1000)
+            r = rng.random()
+            if r < 0.40:
+                db[key] = key
+                model[key] = key
+            elif r < 0.50:
+                if key in model:
+                    del db[key]
+                    del model[key]
+            elif r < 0.99:
+                if db.get(key) != model.get(key):
+                    raise AssertionError("%s has the wrong value" % key)
+            else:
+                if dict(db.items()) != model:
+                    raise AssertionError("items() does not match")
+            ops += 1
+    return ops
+
+
+def reader_pool(pool, records, deadline, rng):
+    """Lookups and iterations through a ReaderPool."""
+    ops = 0
+    while time.perf_counter() < deadline:
+        i = rng.randrange(records)
+        r = rng.random()
+        if r < 0.50:
+            if pool["r%d" % i] != str(i):
+                raise AssertionError("r%d has the wrong value" % i)
+        elif r < 0.75:
+            if pool.get("x%d" % i) is not None:
+                raise AssertionError("x%d should be missing" % i)
+        elif r < 0.999:
+            if ("r%d" % i) not in pool:
+                raise AssertionError("r%d should be present" % i)
+        else:
+            if sum(1 for _ in pool.handle().keys()) != records:
+                raise AssertionError("keys() returned the wrong count")
+        ops += 1
+    return ops
+
+
+def run(nthreads, seconds, target, argsfor):
+    results = [None] * nthreads
+    errors = []
+    start = threading.Barrier(nthreads + 1)
+
+    def worker(tid):
+        rng = random.Random(tid)
+        start.wait()
+        try:
+            results[tid] = target(*argsfor(tid), time.perf_counter() + seconds, rng)
+        except BaseException as e:
+            errors.append("thread %d: %r" % (tid, e))
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(nthreads)]
+    for t in threads:
+        t.start()
+    start.wait()
+    began = time.perf_counter()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - began
+    return sum(r or 0 for r in results) / elapsed, errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--threads", default="1,2,4,8",
+                        help="comma separated thread counts (default 1,2,4,8)")
+    parser.add_argument("--seconds", type=float, default=2.0,
+                        help="duration of each run (default 2)")
+    parser.add_argument("--records", type=int, default=10000,
+                        help="records in the ReaderPool database (default 10000)")
+    args = parser.parse_args()
+    counts = [int(n) for n in args.threads.split(",")]
+
+    free_threaded = bool(sysconfig.get_config_var("Py_GIL_DISABLED"))
+    gil = sys._is_gil_enabled() if hasattr(sys, "_is_gil_enabled") else True
+    print("Python %s, free-threaded build: %s, GIL enabled: %s"
+          % (sys.version.split()[0], free_threaded, gil))
+    if free_threaded and gil:
+        print("FAIL: importing depot re-enabled the GIL")
+        return 1
+
+    tmp = tempfile.mkdtemp(prefix="depot-stress-")
+    failed = False
+    try:
+        path = os.path.join(tmp, "pool.db")
+        with depot.open(path, "n") as db:
+            for i in range(args.records):
+                db["r%d" % i] = str(i)
+
+        print("%-8s %8s %14s %14s %8s"
+              % ("workload", "threads", "ops/s", "ops/s/thread", "scaling"))
+        for name in ("shared", "own", "pool"):
+            base = None
+            for n in counts:
+                if name == "shared":
+                    db = depot.open(os.path.join(tmp, "shared.db"), "n")
+                    rate, errors = run(n, args.seconds, shared_handle,
+                                       lambda tid: (db, tid))
+                    db.close()
+                elif name == "own":
+                    rate, errors = run(n, args.seconds, own_handle,
+                                       lambda tid: (os.path.join(tmp, "own%d.db" % tid), tid))
+                else:
+                    pool = depot.ReaderPool(path, n)
+                    rate, errors = run(n, args.seconds, reader_pool,
+                                       lambda tid: (pool, args.records))
+                    pool.close()
+                base = base or rate / n
+                print("%-8s %8d %14.0f %14.0f %7.2fx"
+                      % (name, n, rate, rate / n, rate / base))
+                for e in errors:
+                    print("  FAIL:", e)
+                    failed = True
+    finally:
+        shutil.rmtree(tmp)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,127 @@
+"""Regression tests for the change log in qdbm.depot.
+
+A position must never silently skip records: resuming from one on a log
+that was recreated, or whose records do not continue from it, raises
+depot.error.  An update whose log batch cannot be written raises
+depot.LogError, and its record is written by the next flushlog().
+
+    python tests/test_changelog.py      (or: python -m pytest tests)
+"""
+
+import os
+import resource
+import shutil
+import signal
+import struct
+import sys
+import tempfile
+
+from qdbm import depot
+
+
+def _fill(path, log, keys):
+    db = depot.open(path, "c", log=log)
+    for key in keys:
+        db[key] = key
+    db.close()
+
+
+def _raises(func, *args):
+    try:
+        func(*args)
+    except depot.error:
+        return
+    raise AssertionError("%s%r did not raise depot.error" % (func.__name__, args))
+
+
+def test_resume(tmp_path):
+    log = os.path.join(tmp_path, "test.log")
+    _fill(os.path.join(tmp_path, "test.db"), log, ["a", "b", "c"])
+    replica = depot.open(os.path.join(tmp_path, "replica.db"), "n")
+    pos = depot.apply(replica, log)
+    assert pos[0] == 4
+    _fill(os.path.join(tmp_path, "test.db"), log, ["d", "e"])
+    assert [r[0] for r in depot.tail(log, pos)] == [4, 5]
+    pos = depot.apply(replica, log, pos)
+    assert pos[0] == 6 and sorted(replica.keys()) == ["a", "b", "c", "d", "e"]
+    assert depot.apply(replica, log, pos) == pos
+    replica.close()
+
+
+def test_recreated_log(tmp_path):
+    log = os.path.join(tmp_path, "test.log")
+    _fill(os.path.join(tmp_path, "test.db"), log, ["old%d" % i for i in range(5)])
+    replica = depot.open(os.path.join(tmp_path, "replica.db"), "n")
+    pos = depot.apply(replica, log)
+    # The log is replaced and grows past the old position's offset
+    os.unlink(log)
+    _fill(os.path.join(tmp_path, "test.db"), log, ["new%d" % i for i in range(8)])
+    _raises(depot.apply, replica, log, pos)
+    _raises(depot.tail, log, pos)
+    # A bare sequence number cannot tell the logs apart, but the records
+    # it needs are still checked for
+    _raises(depot.apply, replica, os.path.join(tmp_path, "missing.log"), pos[0])
+    assert "new0" not in replica
+    replica.close()
+
+
+def test_gap(tmp_path):
+    log = os.path.join(tmp_path, "test.log")
+    _fill(os.path.join(tmp_path, "test.db"), log, ["a", "b"])
+    it = depot.tail(log)
+    list(it)
+    pos = it.position
+    # Append a record numbered 5 where 3 should be
+    with open(log, "ab") as f:
+        f.write(struct.pack(">QcII", 5, b"P", 1, 1) + b"zz")
+    replica = depot.open(os.path.join(tmp_path, "replica.db"), "n")
+    _raises(depot.apply, replica, log, pos)
+    _raises(list, depot.tail(log, pos[0]))
+    assert "z" not in replica
+    replica.close()
+
+
+def test_log_write_failure(tmp_path):
+    log = os.path.join(tmp_path, "test.log")
+    _fill(os.path.join(tmp_path, "old.db"), log, ["k%d" % i for i in range(2000)])
+    db = depot.open(os.path.join(tmp_path, "test.db"), "n", 16, log=log, log_batch=1)
+    # Leave no room for another log record; the new database stays smaller
+    limit = os.path.getsize(log)
+    soft, hard = resource.getrlimit(resource.RLIMIT_FSIZE)
+    handler = signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+    try:
+        resource.setrlimit(resource.RLIMIT_FSIZE, (limit, hard))
+        try:
+            db["a"] = "1"
+        except depot.LogError:
+            pass
+        else:
+            raise AssertionError("update did not raise depot.LogError")
+        assert db["a"] == "1"
+    finally:
+        resource.setrlimit(resource.RLIMIT_FSIZE, (soft, hard))
+        signal.signal(signal.SIGXFSZ, handler)
+    db.flushlog()
+    assert list(depot.tail(log, 2001)) == [(2001, "put", "a", "1")]
+    db.close()
+
+
+def main():
+    failed = 0
+    for name, func in sorted(globals().items()):
+        if not name.startswith("test_"):
+            continue
+        tmp = tempfile.mkdtemp(prefix="depot-test-")
+        try:
+            func(tmp)
+            print("ok   ", name)
+        except Exception as e:
+            print("FAIL ", name, repr(e))
+            failed += 1
+        finally:
+            shutil.rmtree(tmp)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())